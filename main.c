@@ -1,16 +1,40 @@
-#define _POSIX_C_SOURCE 200112L
+#define _POSIX_C_SOURCE 200809L
 
 #include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#include <wlr/backend/headless.h>
 #include <wlr/backend/libinput.h>
+#include <wlr/backend/multi.h>
+#include <wlr/interfaces/wlr_keyboard.h>
+#include <wlr/interfaces/wlr_pointer.h>
 #include <wlr/render/allocator.h>
 #include <wlr/render/wlr_renderer.h>
 #include <wlr/types/wlr_data_device.h>
+#include <wlr/types/wlr_idle_inhibit_v1.h>
+#include <wlr/types/wlr_idle_notify_v1.h>
+#include <wlr/types/wlr_output_management_v1.h>
+#include <wlr/types/wlr_output_power_management_v1.h>
+#include <wlr/types/wlr_pointer_constraints_v1.h>
+#include <wlr/types/wlr_relative_pointer_v1.h>
 #include <wlr/types/wlr_scene.h>
 #include <wlr/types/wlr_subcompositor.h>
 #include <wlr/types/wlr_xcursor_manager.h>
 #include <wlr/types/wlr_xdg_shell.h>
 #include <wlr/util/log.h>
+#include <wlr/util/region.h>
 
 char* keyboard_layout = "us";
 char* keyboard_optns = "";
@@ -18,10 +42,64 @@ char* terminal = "alacritty";
 char* browser = "firefox";
 char* system_monitor = "alacritty -e btop";
 bool hide_cursor_at_top_left = false;
+char* control_pipe = NULL;
+
+enum tinytile_output_mode_policy {
+  OUTPUT_MODE_PREFERRED,
+  OUTPUT_MODE_HIGHEST_REFRESH,
+};
+enum tinytile_output_mode_policy output_mode_policy = OUTPUT_MODE_PREFERRED;
+unsigned int idle_timeout = 0;
+char* autostart_commands[16];
+int autostart_count = 0;
+char* record_input_path = NULL;
+char* replay_input_path = NULL;
+
+/* Acceleration settings for pointers, by device name or * for any device */
+struct tinytile_pointer_accel {
+  char* device_name;
+  enum libinput_config_accel_profile profile;
+  double speed;
+} pointer_accels[16];
+int pointer_accel_count = 0;
+
+/* Recordings of input start with this, followed by tinytile_input_records */
+#define INPUT_RECORDING_MAGIC "TTIR\x01\0\0\0"
+
+enum tinytile_input_record_type {
+  INPUT_RECORD_KEY,
+  INPUT_RECORD_MOTION,
+  INPUT_RECORD_MOTION_ABSOLUTE,
+  INPUT_RECORD_BUTTON,
+  INPUT_RECORD_AXIS,
+  INPUT_RECORD_FRAME,
+};
+
+struct tinytile_input_record {
+  uint32_t time_msec; /* Since the recording started */
+  uint32_t code;      /* Keycode, button or axis orientation */
+  uint8_t type;
+  uint8_t state; /* Key or button state, or axis source */
+  uint16_t padding;
+  float x, y; /* Deltas, absolute positions or the axis and discrete deltas */
+  float unaccel_x, unaccel_y;
+};
+
+/* A piece of work for the worker threads. Each kind of job embeds this in a
+ * struct holding its inputs and results, and gets back to it in work and
+ * done with wl_container_of. */
+struct tinytile_job {
+  struct wl_list link;
+  /* Runs on a worker thread, so must not touch any compositor state */
+  void (*work)(struct tinytile_job* job);
+  /* Runs on the main thread once work has finished, and frees the job */
+  void (*done)(struct tinytile_job* job);
+};
 
 struct tinytile_server {
   struct wl_display* wl_display;
   struct wlr_backend* backend;
+  struct wlr_backend* headless_backend;
   struct wlr_renderer* renderer;
   struct wlr_allocator* allocator;
   struct wlr_scene* scene;
@@ -32,21 +110,87 @@ struct tinytile_server {
 
   struct wlr_cursor* cursor;
   struct wlr_xcursor_manager* cursor_mgr;
+  bool cursor_theme_loaded;
   struct wl_listener cursor_motion;
   struct wl_listener cursor_motion_absolute;
   struct wl_listener cursor_button;
   struct wl_listener cursor_axis;
   struct wl_listener cursor_frame;
 
+  struct wlr_relative_pointer_manager_v1* relative_pointer_manager;
+  struct wlr_pointer_constraints_v1* pointer_constraints;
+  struct wl_listener new_pointer_constraint;
+  struct wlr_pointer_constraint_v1* active_constraint;
+
   struct wlr_seat* seat;
   struct wl_listener new_input;
   struct wl_listener request_cursor;
   struct wl_listener request_set_selection;
   struct wl_list keyboards;
+  struct xkb_keymap* keymap;
+  struct wl_array held_keys;
 
   struct wlr_output_layout* output_layout;
   struct wl_list outputs;
   struct wl_listener new_output;
+  struct wl_listener output_layout_change;
+
+  struct wlr_output_manager_v1* output_manager;
+  struct wl_listener output_manager_apply;
+  struct wl_listener output_manager_test;
+
+  struct wlr_output_power_manager_v1* output_power_manager;
+  struct wl_listener output_power_set_mode;
+
+  struct wlr_idle_notifier_v1* idle_notifier;
+  struct wlr_idle_inhibit_manager_v1* idle_inhibit_manager;
+  struct wl_listener new_idle_inhibitor;
+  int idle_inhibitors;
+  struct wl_event_source* idle_timer;
+  uint32_t last_activity_msec;
+  bool outputs_idle;
+
+  struct wlr_session* session;
+  struct wl_listener session_active;
+
+  FILE* input_recording;
+  uint32_t input_recording_start_msec;
+
+  FILE* input_replay;
+  struct tinytile_input_record replay_next;
+  struct wlr_keyboard replay_keyboard;
+  struct wlr_pointer replay_pointer;
+  struct wl_event_source* replay_timer;
+  int64_t replay_start_usec;
+  int64_t replay_start_cpu_usec;
+  uint64_t replay_events;
+  int64_t replay_total_lateness_usec;
+  int64_t replay_max_lateness_usec;
+
+  pthread_t workers[4];
+  int worker_count;
+  pthread_mutex_t jobs_lock;
+  pthread_cond_t jobs_available;
+  struct wl_list pending_jobs;
+  struct wl_list finished_jobs;
+  bool workers_stopping;
+  int jobs_eventfd;
+  struct wl_event_source* jobs_source;
+
+  int exit_status;
+
+  int64_t startup_usec;
+  int64_t startup_phase_usec;
+  bool first_frame_done;
+
+  struct wl_event_source* sigint_source;
+  struct wl_event_source* sigterm_source;
+
+  int control_pipe_fd;
+  bool created_control_pipe;
+  struct wl_event_source* control_pipe_source;
+  char control_buffer[256];
+  size_t control_buffer_len;
 };
 
 struct tinytile_output {
@@ -55,6 +199,9 @@ struct tinytile_output {
   struct wlr_output* wlr_output;
   struct wl_listener frame;
   struct wl_listener destroy;
+  bool idle_off;
+  /* Set while an output configuration is taking this output away */
+  bool leaving;
 };
 
 struct tinytile_view {
@@ -62,12 +209,39 @@ struct tinytile_view {
   struct tinytile_server* server;
   struct wlr_xdg_toplevel* xdg_toplevel;
   struct wlr_scene_tree* scene_tree;
+  /* Where the view is shown, and the size the client last committed to */
+  struct wlr_box box;
+  /* At most one size change is sent to the client at once, any newer ones
+   * wait in pending_box until it has been acked and committed */
+  uint32_t configure_serial;
+  struct wlr_box configure_box;
+  bool has_pending_box;
+  struct wlr_box pending_box;
+  /* Where the view was on the outputs it has left, relative to the output,
+   * and the output it was last forced off because it went away */
+  struct {
+    char output_name[32];
+    struct wlr_box box;
+  } remembered[4];
+  char evacuated_from[32];
   struct wl_listener map;
   struct wl_listener unmap;
   struct wl_listener destroy;
+  struct wl_listener commit;
   struct wl_listener request_fullscreen;
 };
 
+struct tinytile_pointer_constraint {
+  struct tinytile_server* server;
+  struct wlr_pointer_constraint_v1* constraint;
+  struct wl_listener destroy;
+};
+
+struct tinytile_idle_inhibitor {
+  struct tinytile_server* server;
+  struct wl_listener destroy;
+};
+
 struct tinytile_keyboard {
   struct wl_list link;
   struct tinytile_server* server;
@@ -78,6 +252,11 @@ struct tinytile_keyboard {
   struct wl_listener destroy;
 };
 
+struct tinytile_held_key {
+  struct tinytile_keyboard* keyboard;
+  struct wlr_keyboard_key_event event;
+};
+
 static char* replace_char(char* str, char find, char replace) {
   char* current_pos = strchr(str, find);
   while (current_pos) {
@@ -97,10 +276,479 @@ static inline bool yes_to_bool(char string[]) {
   exit(EXIT_FAILURE);
 }
 
-static void run(const char* command) {
-  if (fork() == 0) {
-    system(command);
-    exit(EXIT_SUCCESS);
+static void add_pointer_accel(char* spec) {
+  /* Parses NAME:PROFILE:SPEED, from the right because device names can have
+   * colons in them */
+  char* speed = strrchr(spec, ':');
+  char* profile = NULL;
+  if (speed) {
+    *speed++ = '\0';
+    profile = strrchr(spec, ':');
+  }
+  if (profile == NULL || pointer_accel_count == 16) {
+    wlr_log(WLR_ERROR,
+            "Please specify pointer acceleration as NAME:PROFILE:SPEED, up to "
+            "16 times");
+    exit(EXIT_FAILURE);
+  }
+  *profile++ = '\0';
+
+  struct tinytile_pointer_accel* accel = &pointer_accels[pointer_accel_count++];
+  accel->device_name = spec;
+  char* end;
+  accel->speed = strtod(speed, &end);
+  if (end == speed || *end != '\0' || accel->speed < -1 || accel->speed > 1) {
+    wlr_log(WLR_ERROR,
+            "Please give the pointer speed as a number from -1 to 1 instead "
+            "of '%s'",
+            speed);
+    exit(EXIT_FAILURE);
+  }
+  if (!strcmp(profile, "adaptive"))
+    accel->profile = LIBINPUT_CONFIG_ACCEL_PROFILE_ADAPTIVE;
+  else if (!strcmp(profile, "flat"))
+    accel->profile = LIBINPUT_CONFIG_ACCEL_PROFILE_FLAT;
+  else {
+    wlr_log(WLR_ERROR, "Please say either adaptive or flat instead of '%s'",
+            profile);
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void* worker_thread(void* data) {
+  struct tinytile_server* server = data;
+  pthread_mutex_lock(&server->jobs_lock);
+  while (!server->workers_stopping) {
+    if (wl_list_empty(&server->pending_jobs)) {
+      pthread_cond_wait(&server->jobs_available, &server->jobs_lock);
+      continue;
+    }
+    struct tinytile_job* job =
+        wl_container_of(server->pending_jobs.prev, job, link);
+    wl_list_remove(&job->link);
+    pthread_mutex_unlock(&server->jobs_lock);
+
+    job->work(job);
+
+    pthread_mutex_lock(&server->jobs_lock);
+    wl_list_insert(&server->finished_jobs, &job->link);
+    /* Wakes up the event loop on the main thread, see handle_finished_jobs */
+    uint64_t one = 1;
+    if (write(server->jobs_eventfd, &one, sizeof(one)) < 0) {
+      wlr_log_errno(WLR_ERROR, "failed to signal a finished job");
+    }
+  }
+  pthread_mutex_unlock(&server->jobs_lock);
+  return NULL;
+}
+
+static int handle_finished_jobs(int fd, uint32_t mask, void* data) {
+  /* This is called by the event loop on the main thread after jobs finish,
+   * the lock is only held long enough to take the finished jobs */
+  struct tinytile_server* server = data;
+  uint64_t count;
+  if (read(fd, &count, sizeof(count)) < 0) {
+    return 0;
+  }
+  struct wl_list finished_jobs;
+  wl_list_init(&finished_jobs);
+  pthread_mutex_lock(&server->jobs_lock);
+  wl_list_insert_list(&finished_jobs, &server->finished_jobs);
+  wl_list_init(&server->finished_jobs);
+  pthread_mutex_unlock(&server->jobs_lock);
+
+  /* Jobs are inserted at the front, so walk backwards to keep them in the
+   * order they finished */
+  struct tinytile_job *job, *tmp;
+  wl_list_for_each_reverse_safe(job, tmp, &finished_jobs, link) {
+    wl_list_remove(&job->link);
+    job->done(job);
+  }
+  return 0;
+}
+
+static void queue_job(struct tinytile_server* server,
+                      struct tinytile_job* job) {
+  pthread_mutex_lock(&server->jobs_lock);
+  wl_list_insert(&server->pending_jobs, &job->link);
+  pthread_cond_signal(&server->jobs_available);
+  pthread_mutex_unlock(&server->jobs_lock);
+}
+
+static bool start_workers(struct tinytile_server* server) {
+  /* One worker per CPU, up to the size of server->workers */
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int max_workers = sizeof(server->workers) / sizeof(server->workers[0]);
+  server->worker_count = cpus < 1 ? 1 : cpus > max_workers ? max_workers : cpus;
+
+  pthread_mutex_init(&server->jobs_lock, NULL);
+  pthread_cond_init(&server->jobs_available, NULL);
+  wl_list_init(&server->pending_jobs);
+  wl_list_init(&server->finished_jobs);
+  server->workers_stopping = false;
+  server->jobs_eventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (server->jobs_eventfd < 0) {
+    wlr_log_errno(WLR_ERROR, "failed to create the eventfd for jobs");
+    return false;
+  }
+  server->jobs_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(server->wl_display), server->jobs_eventfd,
+      WL_EVENT_READABLE, handle_finished_jobs, server);
+
+  for (int i = 0; i < server->worker_count; i++) {
+    if (pthread_create(&server->workers[i], NULL, worker_thread, server)) {
+      wlr_log(WLR_ERROR, "failed to start a worker thread");
+      server->worker_count = i;
+      return false;
+    }
+  }
+  return true;
+}
+
+static void stop_workers(struct tinytile_server* server) {
+  /* Jobs which haven't started yet are dropped */
+  pthread_mutex_lock(&server->jobs_lock);
+  server->workers_stopping = true;
+  pthread_cond_broadcast(&server->jobs_available);
+  pthread_mutex_unlock(&server->jobs_lock);
+  for (int i = 0; i < server->worker_count; i++) {
+    pthread_join(server->workers[i], NULL);
+  }
+  wl_event_source_remove(server->jobs_source);
+  close(server->jobs_eventfd);
+}
+
+struct tinytile_run_job {
+  struct tinytile_job job;
+  const char* command;
+};
+
+static void run_job_work(struct tinytile_job* job) {
+  struct tinytile_run_job* run_job = wl_container_of(job, run_job, job);
+  /* Fork twice so that the command is adopted by init, and we can reap the
+   * middle process straight away instead of leaving zombies around */
+  pid_t pid = fork();
+  if (pid == 0) {
+    if (fork() == 0) {
+      /* The signals we handle are blocked on every thread, and the command
+       * shouldn't inherit that */
+      sigset_t signals;
+      sigemptyset(&signals);
+      sigprocmask(SIG_SETMASK, &signals, NULL);
+      execl("/bin/sh", "sh", "-c", run_job->command, (char*)NULL);
+      _exit(EXIT_FAILURE);
+    }
+    _exit(EXIT_SUCCESS);
+  } else if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+}
+
+static void run_job_done(struct tinytile_job* job) {
+  struct tinytile_run_job* run_job = wl_container_of(job, run_job, job);
+  free(run_job);
+}
+
+static void run(struct tinytile_server* server, const char* command) {
+  /* Forking copies our page tables, which takes long enough to be noticed,
+   * so it is done on a worker thread */
+  struct tinytile_run_job* run_job = calloc(1, sizeof(struct tinytile_run_job));
+  run_job->job.work = run_job_work;
+  run_job->job.done = run_job_done;
+  run_job->command = command;
+  queue_job(server, &run_job->job);
+}
+
+static int64_t clock_usec(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static uint32_t now_msec(void) {
+  return clock_usec(CLOCK_MONOTONIC) / 1000;
+}
+
+static void log_startup_phase(struct tinytile_server* server,
+                              const char* phase) {
+  /* These are meant to be easy to pick out of the log with grep */
+  int64_t now_usec = clock_usec(CLOCK_MONOTONIC);
+  wlr_log(WLR_INFO, "startup: %s took %.2fms, %.2fms since launch", phase,
+          (now_usec - server->startup_phase_usec) / 1000.0,
+          (now_usec - server->startup_usec) / 1000.0);
+  server->startup_phase_usec = now_usec;
+}
+
+static void record_input(struct tinytile_server* server,
+                         struct tinytile_input_record record) {
+  /* stdio buffers the records for us, so this rarely makes a syscall */
+  if (server->input_recording == NULL) {
+    return;
+  }
+  record.time_msec = now_msec() - server->input_recording_start_msec;
+  fwrite(&record, sizeof(record), 1, server->input_recording);
+}
+
+static void set_output_power(struct wlr_output* wlr_output, bool on) {
+  /* A disabled output stops raising frame events entirely */
+  wlr_output_enable(wlr_output, on);
+  if (!wlr_output_commit(wlr_output)) {
+    wlr_log(WLR_ERROR, "failed to turn %s %s", wlr_output->name,
+            on ? "on" : "off");
+  }
+}
+
+static int handle_idle_timer(void* data) {
+  /* This is called by the event loop idleTimeout seconds after it was armed,
+   * but input doesn't re-arm it, so we check how long it has really been */
+  struct tinytile_server* server = data;
+  uint32_t idle_msec = now_msec() - server->last_activity_msec;
+  if (idle_msec < idle_timeout * 1000) {
+    wl_event_source_timer_update(server->idle_timer,
+                                 idle_timeout * 1000 - idle_msec);
+    return 0;
+  }
+  if (server->idle_inhibitors > 0) {
+    /* The timer is re-armed once the last inhibitor goes away */
+    return 0;
+  }
+  if (server->session && !server->session->active) {
+    /* The outputs belong to another VT at the moment */
+    wl_event_source_timer_update(server->idle_timer, idle_timeout * 1000);
+    return 0;
+  }
+
+  struct tinytile_output* output;
+  wl_list_for_each(output, &server->outputs, link) {
+    if (output->wlr_output->enabled) {
+      set_output_power(output->wlr_output, false);
+      output->idle_off = true;
+    }
+  }
+  server->outputs_idle = true;
+  return 0;
+}
+
+static void notify_activity(struct tinytile_server* server) {
+  /* Called on every input event, so this is kept as cheap as possible: the
+   * idle timer isn't touched unless the outputs need waking up */
+  wlr_idle_notifier_v1_notify_activity(server->idle_notifier, server->seat);
+  server->last_activity_msec = now_msec();
+  if (!server->outputs_idle) {
+    return;
+  }
+  struct tinytile_output* output;
+  wl_list_for_each(output, &server->outputs, link) {
+    /* Outputs which were disabled while they were off stay off */
+    if (output->idle_off &&
+        wlr_output_layout_get(server->output_layout, output->wlr_output)) {
+      set_output_power(output->wlr_output, true);
+    }
+    output->idle_off = false;
+  }
+  server->outputs_idle = false;
+  wl_event_source_timer_update(server->idle_timer, idle_timeout * 1000);
+}
+
+static void idle_inhibitor_destroy(struct wl_listener* listener, void* data) {
+  struct tinytile_idle_inhibitor* inhibitor =
+      wl_container_of(listener, inhibitor, destroy);
+  struct tinytile_server* server = inhibitor->server;
+  if (--server->idle_inhibitors == 0) {
+    wlr_idle_notifier_v1_set_inhibited(server->idle_notifier, false);
+    /* Start counting from now rather than from the last input */
+    server->last_activity_msec = now_msec();
+    if (idle_timeout > 0) {
+      wl_event_source_timer_update(server->idle_timer, idle_timeout * 1000);
+    }
+  }
+  wl_list_remove(&inhibitor->destroy.link);
+  free(inhibitor);
+}
+
+static void server_new_idle_inhibitor(struct wl_listener* listener,
+                                      void* data) {
+  /* This event is raised when a client, such as a video player, asks us not
+   * to go idle until it destroys the inhibitor */
+  struct tinytile_server* server =
+      wl_container_of(listener, server, new_idle_inhibitor);
+  struct wlr_idle_inhibitor_v1* wlr_inhibitor = data;
+
+  struct tinytile_idle_inhibitor* inhibitor =
+      calloc(1, sizeof(struct tinytile_idle_inhibitor));
+  inhibitor->server = server;
+  inhibitor->destroy.notify = idle_inhibitor_destroy;
+  wl_signal_add(&wlr_inhibitor->events.destroy, &inhibitor->destroy);
+
+  server->idle_inhibitors++;
+  wlr_idle_notifier_v1_set_inhibited(server->idle_notifier, true);
+}
+
+static void server_session_active(struct wl_listener* listener, void* data) {
+  /* This event is raised when we switch to or away from the VT that tinytile
+   * is running on. While we are away output_frame does nothing, so once we
+   * are back we need to ask every output for a frame. */
+  struct tinytile_server* server =
+      wl_container_of(listener, server, session_active);
+  if (!server->session->active) {
+    return;
+  }
+  notify_activity(server);
+  struct tinytile_output* output;
+  wl_list_for_each(output, &server->outputs, link) {
+    if (output->wlr_output->enabled) {
+      wlr_output_schedule_frame(output->wlr_output);
+    }
+  }
+}
+
+static void view_flush_geometry(struct tinytile_view* view) {
+  view->has_pending_box = false;
+  if (view->configure_serial == 0 &&
+      view->pending_box.width == view->box.width &&
+      view->pending_box.height == view->box.height) {
+    /* The client has nothing to do for a move, so it happens straight away.
+     * With a resize in flight it has to be sent the size again instead, to
+     * replace that. */
+    view->box = view->pending_box;
+    wlr_scene_node_set_position(&view->scene_tree->node, view->box.x,
+                                view->box.y);
+    return;
+  }
+  view->configure_box = view->pending_box;
+  view->configure_serial = wlr_xdg_toplevel_set_size(
+      view->xdg_toplevel, view->configure_box.width,
+      view->configure_box.height);
+}
+
+static void view_set_geometry(struct tinytile_view* view, struct wlr_box box) {
+  /* Slow clients can't keep up with a configure for every step of a drag,
+   * such as of a split divider, so until they catch up we only remember the
+   * latest geometry. The view stays where it is meanwhile, so its last
+   * buffer still lines up. */
+  view->pending_box = box;
+  view->has_pending_box = true;
+  if (view->configure_serial == 0) {
+    view_flush_geometry(view);
+  }
+}
+
+static void view_set_geometry_now(struct tinytile_view* view,
+                                  struct wlr_box box) {
+  /* Unlike view_set_geometry, this doesn't wait for a configure in flight,
+   * but replaces it, and the view moves before the client has resized */
+  view->pending_box = box;
+  view_flush_geometry(view);
+  view->box.x = box.x;
+  view->box.y = box.y;
+  wlr_scene_node_set_position(&view->scene_tree->node, view->box.x,
+                              view->box.y);
+}
+
+static struct wlr_box view_latest_box(struct tinytile_view* view) {
+  /* The geometry the view will have once the client has caught up */
+  if (view->has_pending_box)
+    return view->pending_box;
+  else if (view->configure_serial)
+    return view->configure_box;
+  return view->box;
+}
+
+static struct wlr_box* view_remembered_box(struct tinytile_view* view,
+                                           const char* output_name) {
+  for (int i = 0; i < 4; i++) {
+    if (!strcmp(view->remembered[i].output_name, output_name)) {
+      return &view->remembered[i].box;
+    }
+  }
+  return NULL;
+}
+
+static void view_move_to_output(struct tinytile_view* view,
+                                struct wlr_output* wlr_output) {
+  /* The view goes back to where it was on this output, or fills it if it
+   * has never been on it */
+  struct wlr_output_layout_output* layout_output =
+      wlr_output_layout_get(view->server->output_layout, wlr_output);
+  struct wlr_box box = {0};
+  struct wlr_box* remembered = view_remembered_box(view, wlr_output->name);
+  if (remembered)
+    box = *remembered;
+  else
+    wlr_output_effective_resolution(wlr_output, &box.width, &box.height);
+  box.x += layout_output->x;
+  box.y += layout_output->y;
+  view_set_geometry_now(view, box);
+}
+
+static void evacuate_output(struct tinytile_server* server,
+                            struct wlr_output* leaving) {
+  /* Called before an output leaves the layout, moves every view on it to
+   * another output in one go, remembering where it was */
+  struct wlr_output_layout_output* leaving_layout_output =
+      wlr_output_layout_get(server->output_layout, leaving);
+  if (leaving_layout_output == NULL) {
+    return;
+  }
+  /* New outputs are added to the front of the list, so this prefers the
+   * output that has been around longest, such as a laptop's own screen,
+   * over the other outputs of a dock that is being unplugged */
+  struct wlr_output* target = NULL;
+  struct tinytile_output* output;
+  wl_list_for_each_reverse(output, &server->outputs, link) {
+    if (output->wlr_output != leaving && !output->leaving &&
+        wlr_output_layout_get(server->output_layout, output->wlr_output)) {
+      target = output->wlr_output;
+      break;
+    }
+  }
+
+  struct tinytile_view* view;
+  wl_list_for_each(view, &server->views, link) {
+    struct wlr_box box = view_latest_box(view);
+    if (wlr_output_layout_output_at(server->output_layout,
+                                    box.x + box.width / 2.0,
+                                    box.y + box.height / 2.0) != leaving) {
+      continue;
+    }
+    if (view->evacuated_from[0] != '\0') {
+      /* The view is only here because its own output went away, which is
+       * where it should go back to, rather than this one */
+      if (target) {
+        view_move_to_output(view, target);
+      }
+      continue;
+    }
+    struct wlr_box* remembered = view_remembered_box(view, leaving->name);
+    if (remembered == NULL) {
+      /* Forget the output we heard about longest ago */
+      memmove(&view->remembered[1], &view->remembered[0],
+              sizeof(view->remembered) - sizeof(view->remembered[0]));
+      snprintf(view->remembered[0].output_name,
+               sizeof(view->remembered[0].output_name), "%s", leaving->name);
+      remembered = &view->remembered[0].box;
+    }
+    *remembered = box;
+    remembered->x -= leaving_layout_output->x;
+    remembered->y -= leaving_layout_output->y;
+    snprintf(view->evacuated_from, sizeof(view->evacuated_from), "%s",
+             leaving->name);
+    if (target) {
+      view_move_to_output(view, target);
+    }
+  }
+}
+
+static void restore_output(struct tinytile_server* server,
+                           struct wlr_output* returning) {
+  /* Called after an output joins the layout, moves the views that had to
+   * leave it back to where they were */
+  struct tinytile_view* view;
+  wl_list_for_each(view, &server->views, link) {
+    if (!strcmp(view->evacuated_from, returning->name)) {
+      view->evacuated_from[0] = '\0';
+      view_move_to_output(view, returning);
+    }
   }
 }
 
@@ -165,11 +813,9 @@ static void keyboard_handle_modifiers(struct wl_listener* listener,
                                      &keyboard->wlr_keyboard->modifiers);
 }
 
-static void keyboard_handle_key(struct wl_listener* listener, void* data) {
-  /* This event is raised when a key is pressed or released. */
-  struct tinytile_keyboard* keyboard = wl_container_of(listener, keyboard, key);
+static void process_key(struct tinytile_keyboard* keyboard,
+                        struct wlr_keyboard_key_event* event) {
   struct tinytile_server* server = keyboard->server;
-  struct wlr_keyboard_key_event* event = data;
   struct wlr_seat* seat = server->seat;
 
   /* Translate libinput keycode -> xkbcommon */
@@ -204,22 +850,22 @@ static void keyboard_handle_key(struct wl_listener* listener, void* data) {
           }
           return;
         case XKB_KEY_Return:
-          run(terminal);
+          run(server, terminal);
           return;
         case XKB_KEY_b:
-          run(browser);
+          run(server, browser);
           return;
         case XKB_KEY_m:
-          run(system_monitor);
+          run(server, system_monitor);
           return;
         case XKB_KEY_x:
-          run("/bin/systemctl suspend");
+          run(server, "/bin/systemctl suspend");
           return;
         case XKB_KEY_p:
-          run("/bin/systemctl poweroff");
+          run(server, "/bin/systemctl poweroff");
           return;
         case XKB_KEY_r:
-          run("/bin/systemctl reboot");
+          run(server, "/bin/systemctl reboot");
           return;
       }
     } else if (modifiers == (WLR_MODIFIER_ALT | WLR_MODIFIER_CTRL)) {
@@ -270,6 +916,32 @@ static void keyboard_handle_key(struct wl_listener* listener, void* data) {
                                event->state);
 }
 
+static void keyboard_handle_key(struct wl_listener* listener, void* data) {
+  /* This event is raised when a key is pressed or released. */
+  struct tinytile_keyboard* keyboard = wl_container_of(listener, keyboard, key);
+  struct tinytile_server* server = keyboard->server;
+  struct wlr_keyboard_key_event* event = data;
+  notify_activity(server);
+  record_input(server, (struct tinytile_input_record){
+                           .type = INPUT_RECORD_KEY,
+                           .code = event->keycode,
+                           .state = event->state,
+                       });
+
+  /* Until the keymap has been compiled there are no keybindings or modifiers,
+   * so keys are held and processed once it has */
+  if (server->keymap == NULL) {
+    struct tinytile_held_key* held =
+        wl_array_add(&server->held_keys, sizeof(struct tinytile_held_key));
+    if (held) {
+      held->keyboard = keyboard;
+      held->event = *event;
+    }
+    return;
+  }
+  process_key(keyboard, event);
+}
+
 static void keyboard_handle_destroy(struct wl_listener* listener, void* data) {
   /* This event is raised by the keyboard base wlr_input_device to signal
    * the destruction of the wlr_keyboard. It will no longer receive events
@@ -281,9 +953,85 @@ static void keyboard_handle_destroy(struct wl_listener* listener, void* data) {
   wl_list_remove(&keyboard->key.link);
   wl_list_remove(&keyboard->destroy.link);
   wl_list_remove(&keyboard->link);
+
+  /* Drop any keys that are still held for the keymap */
+  struct wl_array* held_keys = &keyboard->server->held_keys;
+  struct tinytile_held_key* keys = held_keys->data;
+  size_t kept = 0;
+  for (size_t i = 0; i < held_keys->size / sizeof(*keys); i++) {
+    if (keys[i].keyboard != keyboard) {
+      keys[kept++] = keys[i];
+    }
+  }
+  held_keys->size = kept * sizeof(*keys);
   free(keyboard);
 }
 
+struct tinytile_keymap_job {
+  struct tinytile_job job;
+  struct tinytile_server* server;
+  struct xkb_keymap* keymap;
+};
+
+static void keymap_job_work(struct tinytile_job* job) {
+  /* Compiling a keymap takes tens of milliseconds, and every keyboard uses
+   * the same one, so it is compiled once on a worker thread */
+  struct tinytile_keymap_job* keymap_job =
+      wl_container_of(job, keymap_job, job);
+  struct xkb_context* context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+  keymap_job->keymap = xkb_keymap_new_from_names(
+      context,
+      &(struct xkb_rule_names){.layout = keyboard_layout,
+                               .options = keyboard_optns},
+      XKB_KEYMAP_COMPILE_NO_FLAGS);
+  xkb_context_unref(context);
+}
+
+static void keymap_job_done(struct tinytile_job* job) {
+  struct tinytile_keymap_job* keymap_job =
+      wl_container_of(job, keymap_job, job);
+  struct tinytile_server* server = keymap_job->server;
+  if (keymap_job->keymap == NULL) {
+    /* Exiting through the event loop lets main clean up after us */
+    wlr_log(WLR_ERROR, "failed to compile the keymap");
+    free(keymap_job);
+    server->exit_status = EXIT_FAILURE;
+    wl_display_terminate(server->wl_display);
+    return;
+  }
+
+  /* Keyboards that appeared while it was compiling get it now, which also
+   * presses any keys that are still down in their xkb state */
+  server->keymap = keymap_job->keymap;
+  struct tinytile_keyboard* keyboard;
+  wl_list_for_each(keyboard, &server->keyboards, link) {
+    wlr_keyboard_set_keymap(keyboard->wlr_keyboard, server->keymap);
+  }
+  free(keymap_job);
+
+  struct tinytile_held_key* held;
+  wl_array_for_each(held, &server->held_keys) {
+    process_key(held->keyboard, &held->event);
+  }
+  wl_array_release(&server->held_keys);
+  wl_array_init(&server->held_keys);
+
+  /* The replay waits for the keymap, so that how long it took to compile
+   * can't change what the replay does */
+  if (server->replay_timer) {
+    wl_event_source_timer_update(server->replay_timer, 1);
+  }
+}
+
+static void compile_keymap(struct tinytile_server* server) {
+  struct tinytile_keymap_job* keymap_job =
+      calloc(1, sizeof(struct tinytile_keymap_job));
+  keymap_job->job.work = keymap_job_work;
+  keymap_job->job.done = keymap_job_done;
+  keymap_job->server = server;
+  queue_job(server, &keymap_job->job);
+}
+
 static void server_new_keyboard(struct tinytile_server* server,
                                 struct wlr_input_device* device) {
   struct wlr_keyboard* wlr_keyboard = wlr_keyboard_from_input_device(device);
@@ -293,17 +1041,11 @@ static void server_new_keyboard(struct tinytile_server* server,
   keyboard->server = server;
   keyboard->wlr_keyboard = wlr_keyboard;
 
-  /* We need to prepare an XKB keymap and assign it to the keyboard. */
-  struct xkb_context* context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
-  struct xkb_keymap* keymap = xkb_keymap_new_from_names(
-      context,
-      &(struct xkb_rule_names){.layout = keyboard_layout,
-                               .options = keyboard_optns},
-      XKB_KEYMAP_COMPILE_NO_FLAGS);
-
-  wlr_keyboard_set_keymap(wlr_keyboard, keymap);
-  xkb_keymap_unref(keymap);
-  xkb_context_unref(context);
+  /* We need to assign an XKB keymap to the keyboard, if it hasn't been
+   * compiled yet then keymap_job_done does this instead. */
+  if (server->keymap) {
+    wlr_keyboard_set_keymap(wlr_keyboard, server->keymap);
+  }
   wlr_keyboard_set_repeat_info(wlr_keyboard, 25, 600);
 
   /* Here we set up listeners for keyboard events. */
@@ -324,25 +1066,45 @@ static void server_new_pointer(struct tinytile_server* server,
                                struct wlr_input_device* device) {
   /* We don't do anything special with pointers; all of our pointer handling
    * consists of setting up mouse accelaration on libinput and then getting
-   * wlroots to do the dirty work. */
+   * wlroots to do the dirty work. Pointers from other backends, such as the
+   * one replaying recorded input, are attached as they are. */
   struct wlr_pointer* pointer = wlr_pointer_from_input_device(device);
   if (wlr_input_device_is_libinput(&pointer->base)) {
+    /* Settings for this device take priority over the ones for any device,
+     * which take priority over our defaults */
+    struct tinytile_pointer_accel accel = {
+        .profile = LIBINPUT_CONFIG_ACCEL_PROFILE_ADAPTIVE,
+        .speed = 0.75,
+    };
+    for (int i = 0; i < pointer_accel_count; i++) {
+      if (!strcmp(pointer_accels[i].device_name, device->name)) {
+        accel = pointer_accels[i];
+        break;
+      } else if (!strcmp(pointer_accels[i].device_name, "*")) {
+        accel = pointer_accels[i];
+      }
+    }
     struct libinput_device* libinput_device =
         (struct libinput_device*)wlr_libinput_get_device_handle(&pointer->base);
     if (libinput_device_config_accel_is_available(libinput_device)) {
-      libinput_device_config_accel_set_profile(
-          libinput_device, LIBINPUT_CONFIG_ACCEL_PROFILE_ADAPTIVE);
-      libinput_device_config_accel_set_speed(libinput_device, 0.75);
+      enum libinput_config_status profile_status =
+          libinput_device_config_accel_set_profile(libinput_device,
+                                                   accel.profile);
+      enum libinput_config_status speed_status =
+          libinput_device_config_accel_set_speed(libinput_device,
+                                                 accel.speed);
+      if (profile_status != LIBINPUT_CONFIG_STATUS_SUCCESS ||
+          speed_status != LIBINPUT_CONFIG_STATUS_SUCCESS) {
+        wlr_log(WLR_ERROR, "failed to set the pointer acceleration of %s",
+                device->name);
+      }
     }
-    wlr_cursor_attach_input_device(server->cursor, device);
   }
+  wlr_cursor_attach_input_device(server->cursor, device);
 }
 
-static void server_new_input(struct wl_listener* listener, void* data) {
-  /* This event is raised by the backend when a new input device becomes
-   * available. */
-  struct tinytile_server* server = wl_container_of(listener, server, new_input);
-  struct wlr_input_device* device = data;
+static void add_input_device(struct tinytile_server* server,
+                             struct wlr_input_device* device) {
   switch (device->type) {
     case WLR_INPUT_DEVICE_KEYBOARD:
       server_new_keyboard(server, device);
@@ -363,6 +1125,19 @@ static void server_new_input(struct wl_listener* listener, void* data) {
   wlr_seat_set_capabilities(server->seat, caps);
 }
 
+static void server_new_input(struct wl_listener* listener, void* data) {
+  /* This event is raised by the backend when a new input device becomes
+   * available. */
+  struct tinytile_server* server = wl_container_of(listener, server, new_input);
+  struct wlr_input_device* device = data;
+  if (server->input_replay) {
+    /* Real input would be mixed into the run being measured */
+    wlr_log(WLR_INFO, "Ignoring %s while replaying input", device->name);
+    return;
+  }
+  add_input_device(server, device);
+}
+
 static void seat_request_cursor(struct wl_listener* listener, void* data) {
   struct tinytile_server* server =
       wl_container_of(listener, server, request_cursor);
@@ -425,12 +1200,109 @@ static struct tinytile_view* desktop_view_at(struct tinytile_server* server,
   return tree->node.data;
 }
 
+static double clamp_to_span(double value, int32_t start, int32_t end) {
+  /* Spans of a pixman region include their start but not their end */
+  if (value < start)
+    return start;
+  else if (value >= end)
+    return end - 1;
+  return value;
+}
+
+static void activate_pointer_constraint(
+    struct tinytile_server* server,
+    struct wlr_pointer_constraint_v1* constraint) {
+  if (server->active_constraint == constraint) {
+    return;
+  }
+  if (server->active_constraint) {
+    wlr_pointer_constraint_v1_send_deactivated(server->active_constraint);
+  }
+  server->active_constraint = constraint;
+  if (constraint == NULL) {
+    return;
+  }
+  wlr_pointer_constraint_v1_send_activated(constraint);
+  if (constraint->type != WLR_POINTER_CONSTRAINT_V1_CONFINED) {
+    return;
+  }
+
+  /* Motion can only be confined when it starts inside the region, so the
+   * cursor is warped to the nearest point of it */
+  double sx = server->seat->pointer_state.sx;
+  double sy = server->seat->pointer_state.sy;
+  double closest_sx = sx, closest_sy = sy, closest_distance = -1;
+  int rect_count;
+  pixman_box32_t* rects =
+      pixman_region32_rectangles(&constraint->region, &rect_count);
+  for (int i = 0; i < rect_count; i++) {
+    double x = clamp_to_span(sx, rects[i].x1, rects[i].x2);
+    double y = clamp_to_span(sy, rects[i].y1, rects[i].y2);
+    double distance = (x - sx) * (x - sx) + (y - sy) * (y - sy);
+    if (closest_distance < 0 || distance < closest_distance) {
+      closest_sx = x;
+      closest_sy = y;
+      closest_distance = distance;
+    }
+  }
+  if (closest_distance > 0) {
+    wlr_cursor_move(server->cursor, NULL, closest_sx - sx, closest_sy - sy);
+    wlr_seat_pointer_notify_motion(server->seat, now_msec(), closest_sx,
+                                   closest_sy);
+  }
+}
+
+static void pointer_constraint_destroy(struct wl_listener* listener,
+                                       void* data) {
+  struct tinytile_pointer_constraint* pointer_constraint =
+      wl_container_of(listener, pointer_constraint, destroy);
+  struct tinytile_server* server = pointer_constraint->server;
+  if (server->active_constraint == pointer_constraint->constraint) {
+    server->active_constraint = NULL;
+  }
+  wl_list_remove(&pointer_constraint->destroy.link);
+  free(pointer_constraint);
+}
+
+static void server_new_pointer_constraint(struct wl_listener* listener,
+                                          void* data) {
+  /* This event is raised when a client, usually a game, wants to lock the
+   * pointer in place or confine it to a region of one of its surfaces. The
+   * constraint is only active while that surface has pointer focus. */
+  struct tinytile_server* server =
+      wl_container_of(listener, server, new_pointer_constraint);
+  struct wlr_pointer_constraint_v1* constraint = data;
+
+  struct tinytile_pointer_constraint* pointer_constraint =
+      calloc(1, sizeof(struct tinytile_pointer_constraint));
+  pointer_constraint->server = server;
+  pointer_constraint->constraint = constraint;
+  pointer_constraint->destroy.notify = pointer_constraint_destroy;
+  wl_signal_add(&constraint->events.destroy, &pointer_constraint->destroy);
+
+  if (constraint->surface == server->seat->pointer_state.focused_surface) {
+    activate_pointer_constraint(server, constraint);
+  }
+}
+
+static void set_default_cursor_image(struct tinytile_server* server) {
+  /* Loading the cursor theme reads a lot of files, so rather than slowing
+   * down startup it is done the first time the cursor is shown */
+  if (!server->cursor_theme_loaded) {
+    wlr_xcursor_manager_load(server->cursor_mgr, 1);
+    server->cursor_theme_loaded = true;
+  }
+  wlr_xcursor_manager_set_cursor_image(server->cursor_mgr, "left_ptr",
+                                       server->cursor);
+}
+
 static void process_cursor_motion(struct tinytile_server* server,
                                   uint32_t time) {
   if (hide_cursor_at_top_left && server->cursor->x <= 3 &&
       server->cursor->y <= 3) {
     wlr_cursor_set_image(server->cursor, NULL, 0, 0, 0, 0, 0, 0);
     wlr_seat_pointer_notify_clear_focus(server->seat);
+    activate_pointer_constraint(server, NULL);
     return;
   }
   /* Find the view under the pointer and send the event along. */
@@ -443,9 +1315,9 @@ static void process_cursor_motion(struct tinytile_server* server,
     /* If there's no view under the cursor, set the cursor image to a
      * default. This is what makes the cursor image appear when you move it
      * around the screen, not over any views. */
-    wlr_xcursor_manager_set_cursor_image(server->cursor_mgr, "left_ptr",
-                                         server->cursor);
+    set_default_cursor_image(server);
   }
+  bool focus_changed = surface != seat->pointer_state.focused_surface;
   if (surface) {
     /*
      * Send pointer enter and motion events.
@@ -465,6 +1337,15 @@ static void process_cursor_motion(struct tinytile_server* server,
      * the last client to have the cursor over it. */
     wlr_seat_pointer_clear_focus(seat);
   }
+
+  /* Pointer constraints follow pointer focus. They are activated after the
+   * seat has the new position, since a confinement may need to warp it. */
+  if (focus_changed) {
+    activate_pointer_constraint(
+        server, surface ? wlr_pointer_constraints_v1_constraint_for_surface(
+                              server->pointer_constraints, surface, seat)
+                        : NULL);
+  }
 }
 
 static void server_cursor_motion(struct wl_listener* listener, void* data) {
@@ -473,13 +1354,44 @@ static void server_cursor_motion(struct wl_listener* listener, void* data) {
   struct tinytile_server* server =
       wl_container_of(listener, server, cursor_motion);
   struct wlr_pointer_motion_event* event = data;
+  notify_activity(server);
+  record_input(server, (struct tinytile_input_record){
+                           .type = INPUT_RECORD_MOTION,
+                           .x = event->delta_x,
+                           .y = event->delta_y,
+                           .unaccel_x = event->unaccel_dx,
+                           .unaccel_y = event->unaccel_dy,
+                       });
+  /* Clients such as games get the raw deltas, before acceleration and
+   * before any pointer constraint or the edge of the layout stops them. */
+  wlr_relative_pointer_manager_v1_send_relative_motion(
+      server->relative_pointer_manager, server->seat,
+      (uint64_t)event->time_msec * 1000, event->delta_x, event->delta_y,
+      event->unaccel_dx, event->unaccel_dy);
+
+  double dx = event->delta_x, dy = event->delta_y;
+  struct wlr_pointer_constraint_v1* constraint = server->active_constraint;
+  if (constraint && constraint->type == WLR_POINTER_CONSTRAINT_V1_LOCKED) {
+    return;
+  } else if (constraint) {
+    /* Keep the cursor inside the confinement region, which is in surface
+     * local coordinates */
+    double sx = server->seat->pointer_state.sx;
+    double sy = server->seat->pointer_state.sy;
+    double confined_sx, confined_sy;
+    if (wlr_region_confine(&constraint->region, sx, sy, sx + dx, sy + dy,
+                           &confined_sx, &confined_sy)) {
+      dx = confined_sx - sx;
+      dy = confined_sy - sy;
+    }
+  }
+
   /* The cursor doesn't move unless we tell it to. The cursor automatically
    * handles constraining the motion to the output layout, as well as any
    * special configuration applied for the specific input device which
    * generated the event. You can pass NULL for the device if you want to move
    * the cursor around without any input. */
-  wlr_cursor_move(server->cursor, &event->pointer->base, event->delta_x,
-                  event->delta_y);
+  wlr_cursor_move(server->cursor, &event->pointer->base, dx, dy);
   process_cursor_motion(server, event->time_msec);
 }
 
@@ -494,6 +1406,12 @@ static void server_cursor_motion_absolute(struct wl_listener* listener,
   struct tinytile_server* server =
       wl_container_of(listener, server, cursor_motion_absolute);
   struct wlr_pointer_motion_absolute_event* event = data;
+  notify_activity(server);
+  record_input(server, (struct tinytile_input_record){
+                           .type = INPUT_RECORD_MOTION_ABSOLUTE,
+                           .x = event->x,
+                           .y = event->y,
+                       });
   wlr_cursor_warp_absolute(server->cursor, &event->pointer->base, event->x,
                            event->y);
   process_cursor_motion(server, event->time_msec);
@@ -505,6 +1423,12 @@ static void server_cursor_button(struct wl_listener* listener, void* data) {
   struct tinytile_server* server =
       wl_container_of(listener, server, cursor_button);
   struct wlr_pointer_button_event* event = data;
+  notify_activity(server);
+  record_input(server, (struct tinytile_input_record){
+                           .type = INPUT_RECORD_BUTTON,
+                           .code = event->button,
+                           .state = event->state,
+                       });
   /* Notify the client with pointer focus that a button press has occurred */
   wlr_seat_pointer_notify_button(server->seat, event->time_msec, event->button,
                                  event->state);
@@ -524,6 +1448,14 @@ static void server_cursor_axis(struct wl_listener* listener, void* data) {
   struct tinytile_server* server =
       wl_container_of(listener, server, cursor_axis);
   struct wlr_pointer_axis_event* event = data;
+  notify_activity(server);
+  record_input(server, (struct tinytile_input_record){
+                           .type = INPUT_RECORD_AXIS,
+                           .code = event->orientation,
+                           .state = event->source,
+                           .x = event->delta,
+                           .y = event->delta_discrete,
+                       });
   /* Notify the client with pointer focus of the axis event. */
   wlr_seat_pointer_notify_axis(server->seat, event->time_msec,
                                event->orientation, event->delta,
@@ -537,21 +1469,47 @@ static void server_cursor_frame(struct wl_listener* listener, void* data) {
    * same time, in which case a frame event won't be sent in between. */
   struct tinytile_server* server =
       wl_container_of(listener, server, cursor_frame);
+  record_input(server,
+               (struct tinytile_input_record){.type = INPUT_RECORD_FRAME});
   /* Notify the client with pointer focus of the frame event. */
   wlr_seat_pointer_notify_frame(server->seat);
 }
 
+static void show_initial_cursor(struct tinytile_server* server) {
+  /* This is done after the first frame, so that loading the cursor theme
+   * doesn't delay it. It also gives pointer focus to whatever is under the
+   * cursor by now. */
+  server->first_frame_done = true;
+  log_startup_phase(server, "rendering the first frame");
+  process_cursor_motion(server, now_msec());
+}
+
 static void output_frame(struct wl_listener* listener, void* data) {
   /* This function is called every time an output is ready to display a frame,
    * generally at the output's refresh rate (e.g. 60Hz). */
   struct tinytile_output* output = wl_container_of(listener, output, frame);
   struct wlr_scene* scene = output->server->scene;
 
+  /* The whole render pipeline is paused while we are switched to another
+   * VT, including frame callbacks to clients */
+  struct wlr_session* session = output->server->session;
+  if (session && !session->active) {
+    return;
+  }
+
+  /* Outputs that have been turned off are also removed from the layout, so
+   * they have no scene output */
   struct wlr_scene_output* scene_output =
       wlr_scene_get_scene_output(scene, output->wlr_output);
+  if (!output->wlr_output->enabled || scene_output == NULL) {
+    return;
+  }
 
   /* Render the scene if needed and commit the output */
-  wlr_scene_output_commit(scene_output);
+  if (wlr_scene_output_commit(scene_output) &&
+      !output->server->first_frame_done) {
+    show_initial_cursor(output->server);
+  }
 
   struct timespec now;
   clock_gettime(CLOCK_MONOTONIC, &now);
@@ -561,12 +1519,29 @@ static void output_frame(struct wl_listener* listener, void* data) {
 static void output_destroy(struct wl_listener* listener, void* data) {
   struct tinytile_output* output = wl_container_of(listener, output, destroy);
 
+  evacuate_output(output->server, output->wlr_output);
   wl_list_remove(&output->frame.link);
   wl_list_remove(&output->destroy.link);
   wl_list_remove(&output->link);
   free(output);
 }
 
+static struct wlr_output_mode* pick_output_mode(struct wlr_output* wlr_output) {
+  struct wlr_output_mode* best = wlr_output_preferred_mode(wlr_output);
+  if (output_mode_policy == OUTPUT_MODE_HIGHEST_REFRESH) {
+    /* The preferred mode is the native resolution, but frequently not the
+     * highest refresh rate available at it */
+    struct wlr_output_mode* mode;
+    wl_list_for_each(mode, &wlr_output->modes, link) {
+      if (mode->width == best->width && mode->height == best->height &&
+          mode->refresh > best->refresh) {
+        best = mode;
+      }
+    }
+  }
+  return best;
+}
+
 static void server_new_output(struct wl_listener* listener, void* data) {
   /* This event is raised by the backend when a new output (aka a display or
    * monitor) becomes available. */
@@ -581,12 +1556,16 @@ static void server_new_output(struct wl_listener* listener, void* data) {
   /* Some backends don't have modes. DRM+KMS does, and we need to set a mode
    * before we can use the output. The mode is a tuple of (width, height,
    * refresh rate), and each monitor supports only a specific set of modes. We
-   * just pick the monitor's preferred mode, a more sophisticated compositor
-   * would let the user configure it. */
+   * pick one according to outputMode, falling back to the monitor's preferred
+   * mode if that doesn't work. Clients can change it later through the output
+   * manager. */
   if (!wl_list_empty(&wlr_output->modes)) {
-    struct wlr_output_mode* mode = wlr_output_preferred_mode(wlr_output);
+    struct wlr_output_mode* mode = pick_output_mode(wlr_output);
     wlr_output_set_mode(wlr_output, mode);
     wlr_output_enable(wlr_output, true);
+    if (!wlr_output_test(wlr_output)) {
+      wlr_output_set_mode(wlr_output, wlr_output_preferred_mode(wlr_output));
+    }
     if (!wlr_output_commit(wlr_output)) {
       return;
     }
@@ -596,6 +1575,7 @@ static void server_new_output(struct wl_listener* listener, void* data) {
   struct tinytile_output* output = calloc(1, sizeof(struct tinytile_output));
   output->wlr_output = wlr_output;
   output->server = server;
+  wlr_output->data = output;
   /* Sets up a listener for the frame notify event. */
   output->frame.notify = output_frame;
   wl_signal_add(&wlr_output->events.frame, &output->frame);
@@ -616,6 +1596,538 @@ static void server_new_output(struct wl_listener* listener, void* data) {
    * output (such as DPI, scale factor, manufacturer, etc).
    */
   wlr_output_layout_add_auto(server->output_layout, wlr_output);
+  restore_output(server, wlr_output);
+}
+
+static void update_output_manager_config(struct tinytile_server* server) {
+  /* Tell output management clients about the current state of every output,
+   * including the ones which are turned off. Outputs that are only powered
+   * off, such as when idle, are still in the layout and are reported as
+   * enabled, so a client sending this back doesn't disable them for good;
+   * their power is reported by output power management instead. */
+  struct wlr_output_configuration_v1* config =
+      wlr_output_configuration_v1_create();
+  struct tinytile_output* output;
+  wl_list_for_each(output, &server->outputs, link) {
+    struct wlr_output_configuration_head_v1* head =
+        wlr_output_configuration_head_v1_create(config, output->wlr_output);
+    struct wlr_output_layout_output* layout_output =
+        wlr_output_layout_get(server->output_layout, output->wlr_output);
+    head->state.enabled = layout_output != NULL;
+    if (layout_output) {
+      head->state.x = layout_output->x;
+      head->state.y = layout_output->y;
+    }
+  }
+  wlr_output_manager_v1_set_configuration(server->output_manager, config);
+}
+
+static void server_output_layout_change(struct wl_listener* listener,
+                                        void* data) {
+  /* This event is raised whenever an output is added, removed, moved or
+   * changes size */
+  struct tinytile_server* server =
+      wl_container_of(listener, server, output_layout_change);
+  update_output_manager_config(server);
+}
+
+struct tinytile_output_state {
+  bool enabled;
+  struct wlr_output_mode* mode;
+  int32_t width, height, refresh;
+  float scale;
+  enum wl_output_transform transform;
+};
+
+static void stage_output_state(struct wlr_output* wlr_output,
+                               const struct tinytile_output_state* state) {
+  wlr_output_enable(wlr_output, state->enabled);
+  if (state->enabled) {
+    if (state->mode)
+      wlr_output_set_mode(wlr_output, state->mode);
+    else
+      wlr_output_set_custom_mode(wlr_output, state->width, state->height,
+                                 state->refresh);
+    wlr_output_set_scale(wlr_output, state->scale);
+    wlr_output_set_transform(wlr_output, state->transform);
+  }
+}
+
+static void apply_output_config(struct tinytile_server* server,
+                                struct wlr_output_configuration_v1* config,
+                                bool test_only) {
+  /* Every output in the configuration is tested before any is committed, and
+   * if committing one still fails then the ones committed before it are put
+   * back the way they were, so the configuration is either applied as a
+   * whole or not at all */
+  struct tinytile_output_state* previous = calloc(
+      wl_list_length(&config->heads), sizeof(struct tinytile_output_state));
+  bool ok = previous != NULL || wl_list_empty(&config->heads);
+  int i = 0;
+  struct wlr_output_configuration_head_v1* head;
+  wl_list_for_each(head, &config->heads, link) {
+    if (!ok) {
+      break;
+    }
+    struct wlr_output* wlr_output = head->state.output;
+    previous[i++] = (struct tinytile_output_state){
+        .enabled = wlr_output->enabled,
+        .mode = wlr_output->current_mode,
+        .width = wlr_output->width,
+        .height = wlr_output->height,
+        .refresh = wlr_output->refresh,
+        .scale = wlr_output->scale,
+        .transform = wlr_output->transform,
+    };
+    stage_output_state(wlr_output,
+                       &(struct tinytile_output_state){
+                           .enabled = head->state.enabled,
+                           .mode = head->state.mode,
+                           .width = head->state.custom_mode.width,
+                           .height = head->state.custom_mode.height,
+                           .refresh = head->state.custom_mode.refresh,
+                           .scale = head->state.scale,
+                           .transform = head->state.transform,
+                       });
+    if (!wlr_output_test(wlr_output)) {
+      ok = false;
+    }
+  }
+
+  int committed = 0;
+  wl_list_for_each(head, &config->heads, link) {
+    if (test_only || !ok) {
+      wlr_output_rollback(head->state.output);
+    } else if (wlr_output_commit(head->state.output)) {
+      committed++;
+    } else {
+      ok = false;
+    }
+  }
+
+  if (!ok) {
+    i = 0;
+    wl_list_for_each(head, &config->heads, link) {
+      if (i == committed) {
+        break;
+      }
+      stage_output_state(head->state.output, &previous[i++]);
+      if (!wlr_output_commit(head->state.output)) {
+        wlr_log(WLR_ERROR, "failed to restore the configuration of %s",
+                head->state.output->name);
+      }
+    }
+  } else if (!test_only) {
+    /* The layout only changes once every output has been committed. A
+     * disabled output stops raising frame events, and is taken out of the
+     * layout so that nothing is placed on it. The enabled outputs are added
+     * first, so that views on the disabled ones can go to them, and never
+     * to another output that is being disabled. */
+    wl_list_for_each(head, &config->heads, link) {
+      struct tinytile_output* output = head->state.output->data;
+      if (head->state.enabled) {
+        wlr_output_layout_add(server->output_layout, output->wlr_output,
+                              head->state.x, head->state.y);
+      } else {
+        output->leaving = true;
+      }
+    }
+    wl_list_for_each(head, &config->heads, link) {
+      if (!head->state.enabled) {
+        evacuate_output(server, head->state.output);
+        wlr_output_layout_remove(server->output_layout, head->state.output);
+      }
+    }
+    wl_list_for_each(head, &config->heads, link) {
+      struct tinytile_output* output = head->state.output->data;
+      output->leaving = false;
+      if (head->state.enabled) {
+        restore_output(server, output->wlr_output);
+      }
+    }
+  }
+  free(previous);
+
+  if (ok)
+    wlr_output_configuration_v1_send_succeeded(config);
+  else
+    wlr_output_configuration_v1_send_failed(config);
+  wlr_output_configuration_v1_destroy(config);
+  if (!test_only) {
+    update_output_manager_config(server);
+  }
+}
+
+static void output_manager_apply(struct wl_listener* listener, void* data) {
+  /* This event is raised when a client, such as wlr-randr, wants to change
+   * the configuration of the outputs */
+  struct tinytile_server* server =
+      wl_container_of(listener, server, output_manager_apply);
+  apply_output_config(server, data, false);
+}
+
+static void output_manager_test(struct wl_listener* listener, void* data) {
+  /* This is the same as output_manager_apply, except that the client only
+   * wants to know if the configuration would work */
+  struct tinytile_server* server =
+      wl_container_of(listener, server, output_manager_test);
+  apply_output_config(server, data, true);
+}
+
+static void output_power_set_mode(struct wl_listener* listener, void* data) {
+  /* This event is raised when a client, such as swayidle or wlopm, wants to
+   * turn an output on or off */
+  struct tinytile_server* server =
+      wl_container_of(listener, server, output_power_set_mode);
+  struct wlr_output_power_v1_set_mode_event* event = data;
+  struct tinytile_output* output = event->output->data;
+  if (output == NULL) {
+    return;
+  }
+  /* An output that was disabled with output management has been taken out
+   * of the layout, and only output management can turn it back on */
+  bool on = event->mode == ZWLR_OUTPUT_POWER_V1_MODE_ON;
+  if (on && !wlr_output_layout_get(server->output_layout, event->output)) {
+    return;
+  }
+  set_output_power(event->output, on);
+  output->idle_off = false;
+}
+
+static void create_virtual_output(struct tinytile_server* server,
+                                  const char* spec) {
+  /* Virtual outputs are specified as WIDTHxHEIGHT@HZ, the refresh rate being
+   * optional. The headless backend waits 1000000 / mHz milliseconds between
+   * frames, which is 0 above 1000Hz, so that is as fast as it can go. */
+  char* end;
+  long width = strtol(spec, &end, 10), height = 0, refresh = 60;
+  if (*end == 'x')
+    height = strtol(end + 1, &end, 10);
+  if (*end == '@')
+    refresh = strtol(end + 1, &end, 10);
+  if (*end != '\0' || width <= 0 || width > 16384 || height <= 0 ||
+      height > 16384 || refresh <= 0 || refresh > 1000) {
+    wlr_log(WLR_ERROR,
+            "Please specify the virtual output as WIDTHxHEIGHT@HZ, up to "
+            "16384x16384@1000, instead of '%s'",
+            spec);
+    return;
+  }
+
+  /* This raises new_output, so by the time it returns server_new_output has
+   * already set the output up */
+  struct wlr_output* wlr_output =
+      wlr_headless_add_output(server->headless_backend, width, height);
+  if (wlr_output == NULL) {
+    wlr_log(WLR_ERROR, "failed to create a virtual output");
+    return;
+  }
+
+  /* The headless backend paces the frame events of each output with a timer
+   * at the refresh rate of its mode, so a 1Hz output only wakes us up once a
+   * second */
+  wlr_output_set_custom_mode(wlr_output, width, height, refresh * 1000);
+  wlr_output_enable(wlr_output, true);
+  if (!wlr_output_commit(wlr_output)) {
+    wlr_log(WLR_ERROR, "failed to commit the virtual output %s",
+            wlr_output->name);
+    wlr_output_destroy(wlr_output);
+    return;
+  }
+  wlr_log(WLR_INFO, "Created virtual output %s at %ldx%ld@%ldHz",
+          wlr_output->name, width, height, refresh);
+}
+
+static void destroy_virtual_output(struct tinytile_server* server,
+                                   const char* name) {
+  struct tinytile_output* output;
+  wl_list_for_each(output, &server->outputs, link) {
+    if (wlr_output_is_headless(output->wlr_output) &&
+        !strcmp(output->wlr_output->name, name)) {
+      /* This raises destroy, which frees output, so we must not touch it
+       * afterwards */
+      wlr_output_destroy(output->wlr_output);
+      return;
+    }
+  }
+  wlr_log(WLR_ERROR, "There is no virtual output called '%s'", name);
+}
+
+static void run_control_command(struct tinytile_server* server, char* line) {
+  char* argument = strchr(line, ' ');
+  if (argument)
+    *argument++ = '\0';
+  else
+    argument = "";
+
+  if (!strcmp(line, "createOutput"))
+    create_virtual_output(server, argument);
+  else if (!strcmp(line, "destroyOutput"))
+    destroy_virtual_output(server, argument);
+  else if (*line != '\0')
+    wlr_log(WLR_ERROR,
+            "The command '%s' is not a valid command please choose from "
+            "either createOutput or destroyOutput.",
+            line);
+}
+
+static int handle_control_pipe(int fd, uint32_t mask, void* data) {
+  /* This is called by the event loop when somebody writes to the control
+   * pipe. Commands are newline terminated, and may arrive in pieces. */
+  struct tinytile_server* server = data;
+  ssize_t len =
+      read(fd, server->control_buffer + server->control_buffer_len,
+           sizeof(server->control_buffer) - server->control_buffer_len - 1);
+  if (len <= 0) {
+    return 0;
+  }
+  server->control_buffer_len += len;
+  server->control_buffer[server->control_buffer_len] = '\0';
+
+  char* line = server->control_buffer;
+  char* newline;
+  while ((newline = strchr(line, '\n'))) {
+    *newline = '\0';
+    run_control_command(server, line);
+    line = newline + 1;
+  }
+
+  /* Keep any incomplete command around for the next read, unless it can
+   * never fit in the buffer */
+  server->control_buffer_len -= line - server->control_buffer;
+  if (server->control_buffer_len == sizeof(server->control_buffer) - 1) {
+    wlr_log(WLR_ERROR, "Discarding a control command that is too long");
+    server->control_buffer_len = 0;
+  }
+  memmove(server->control_buffer, line, server->control_buffer_len);
+  return 0;
+}
+
+static bool open_control_pipe(struct tinytile_server* server,
+                              const char* path) {
+  /* A pipe that already exists is reused, but only one we create is
+   * removed again when we exit */
+  server->created_control_pipe = mkfifo(path, 0600) == 0;
+  if (!server->created_control_pipe && errno != EEXIST) {
+    wlr_log_errno(WLR_ERROR, "failed to create the control pipe %s", path);
+    return false;
+  }
+  /* Opening our end for writing as well means that the pipe never reaches
+   * EOF when a writer closes it, so we don't spin on a hung up fd */
+  int fd = open(path, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (fd < 0) {
+    wlr_log_errno(WLR_ERROR, "failed to open the control pipe %s", path);
+    return false;
+  }
+  /* Since an existing path is reused, make sure it really is a pipe */
+  struct stat info;
+  if (fstat(fd, &info) != 0 || !S_ISFIFO(info.st_mode)) {
+    wlr_log(WLR_ERROR, "the control pipe %s exists and is not a pipe", path);
+    close(fd);
+    return false;
+  }
+  server->control_buffer_len = 0;
+  server->control_pipe_source = wl_event_loop_add_fd(
+      wl_display_get_event_loop(server->wl_display), fd, WL_EVENT_READABLE,
+      handle_control_pipe, server);
+  if (server->control_pipe_source == NULL) {
+    wlr_log(WLR_ERROR, "failed to listen to the control pipe %s", path);
+    close(fd);
+    if (server->created_control_pipe) {
+      unlink(path);
+    }
+    return false;
+  }
+  server->control_pipe_fd = fd;
+  return true;
+}
+
+static int handle_terminate_signal(int signal_number, void* data) {
+  /* Being killed still shuts down like alt + escape does, so a recording of
+   * input is flushed and the control pipe removed */
+  struct tinytile_server* server = data;
+  wl_display_terminate(server->wl_display);
+  return 0;
+}
+
+static void close_control_pipe(struct tinytile_server* server,
+                               const char* path) {
+  wl_event_source_remove(server->control_pipe_source);
+  server->control_pipe_source = NULL;
+  close(server->control_pipe_fd);
+  if (server->created_control_pipe) {
+    unlink(path);
+  }
+}
+
+static bool start_input_recording(struct tinytile_server* server,
+                                  const char* path) {
+  server->input_recording = fopen(path, "wb");
+  if (server->input_recording == NULL) {
+    wlr_log_errno(WLR_ERROR, "failed to open %s to record input", path);
+    return false;
+  }
+  fwrite(INPUT_RECORDING_MAGIC, 8, 1, server->input_recording);
+  server->input_recording_start_msec = now_msec();
+  return true;
+}
+
+static void replay_input_record(struct tinytile_server* server,
+                                struct tinytile_input_record* record) {
+  /* Feed the event through the virtual devices as if it came from hardware,
+   * so it takes the same path through tinytile as the original did */
+  uint32_t time_msec = server->replay_start_usec / 1000 + record->time_msec;
+  struct wlr_pointer* pointer = &server->replay_pointer;
+  switch (record->type) {
+    case INPUT_RECORD_KEY:
+      wlr_keyboard_notify_key(&server->replay_keyboard,
+                              &(struct wlr_keyboard_key_event){
+                                  .time_msec = time_msec,
+                                  .keycode = record->code,
+                                  .update_state = true,
+                                  .state = record->state,
+                              });
+      break;
+    case INPUT_RECORD_MOTION:
+      wl_signal_emit_mutable(&pointer->events.motion,
+                             &(struct wlr_pointer_motion_event){
+                                 .pointer = pointer,
+                                 .time_msec = time_msec,
+                                 .delta_x = record->x,
+                                 .delta_y = record->y,
+                                 .unaccel_dx = record->unaccel_x,
+                                 .unaccel_dy = record->unaccel_y,
+                             });
+      break;
+    case INPUT_RECORD_MOTION_ABSOLUTE:
+      wl_signal_emit_mutable(&pointer->events.motion_absolute,
+                             &(struct wlr_pointer_motion_absolute_event){
+                                 .pointer = pointer,
+                                 .time_msec = time_msec,
+                                 .x = record->x,
+                                 .y = record->y,
+                             });
+      break;
+    case INPUT_RECORD_BUTTON:
+      wl_signal_emit_mutable(&pointer->events.button,
+                             &(struct wlr_pointer_button_event){
+                                 .pointer = pointer,
+                                 .time_msec = time_msec,
+                                 .button = record->code,
+                                 .state = record->state,
+                             });
+      break;
+    case INPUT_RECORD_AXIS:
+      wl_signal_emit_mutable(&pointer->events.axis,
+                             &(struct wlr_pointer_axis_event){
+                                 .pointer = pointer,
+                                 .time_msec = time_msec,
+                                 .orientation = record->code,
+                                 .source = record->state,
+                                 .delta = record->x,
+                                 .delta_discrete = record->y,
+                             });
+      break;
+    case INPUT_RECORD_FRAME:
+      wl_signal_emit_mutable(&pointer->events.frame, pointer);
+      break;
+  }
+}
+
+static int handle_replay_timer(void* data) {
+  /* Replays every event that is due, then sleeps until the next one. The
+   * lateness of each event tells us how well we kept up. */
+  struct tinytile_server* server = data;
+  if (server->replay_start_usec == 0) {
+    server->replay_start_usec = clock_usec(CLOCK_MONOTONIC);
+    server->replay_start_cpu_usec = clock_usec(CLOCK_PROCESS_CPUTIME_ID);
+  }
+
+  while (true) {
+    int64_t due_usec = server->replay_start_usec +
+                       (int64_t)server->replay_next.time_msec * 1000;
+    int64_t lateness_usec = clock_usec(CLOCK_MONOTONIC) - due_usec;
+    if (lateness_usec < 0) {
+      /* Timers can't be armed for 0ms, since that disarms them */
+      wl_event_source_timer_update(server->replay_timer,
+                                   -lateness_usec / 1000 + 1);
+      return 0;
+    }
+
+    replay_input_record(server, &server->replay_next);
+    server->replay_events++;
+    server->replay_total_lateness_usec += lateness_usec;
+    if (lateness_usec > server->replay_max_lateness_usec) {
+      server->replay_max_lateness_usec = lateness_usec;
+    }
+
+    if (fread(&server->replay_next, sizeof(server->replay_next), 1,
+              server->input_replay) != 1) {
+      break;
+    }
+  }
+
+  /* This is what to compare between builds, so we exit afterwards to make
+   * scripting easy */
+  int64_t elapsed_usec =
+      clock_usec(CLOCK_MONOTONIC) - server->replay_start_usec;
+  int64_t cpu_usec =
+      clock_usec(CLOCK_PROCESS_CPUTIME_ID) - server->replay_start_cpu_usec;
+  wlr_log(WLR_INFO,
+          "Replayed %llu input events in %lldms using %lldms of CPU time, "
+          "mean lateness %lldus, max lateness %lldus",
+          (unsigned long long)server->replay_events,
+          (long long)elapsed_usec / 1000, (long long)cpu_usec / 1000,
+          (long long)(server->replay_total_lateness_usec /
+                      (int64_t)server->replay_events),
+          (long long)server->replay_max_lateness_usec);
+  fclose(server->input_replay);
+  server->input_replay = NULL;
+  wlr_keyboard_finish(&server->replay_keyboard);
+  wlr_pointer_finish(&server->replay_pointer);
+  wl_display_terminate(server->wl_display);
+  return 0;
+}
+
+static bool start_input_replay(struct tinytile_server* server,
+                               const char* path) {
+  server->input_replay = fopen(path, "rb");
+  if (server->input_replay == NULL) {
+    wlr_log_errno(WLR_ERROR, "failed to open %s to replay input", path);
+    return false;
+  }
+  char magic[8];
+  if (fread(magic, sizeof(magic), 1, server->input_replay) != 1 ||
+      memcmp(magic, INPUT_RECORDING_MAGIC, sizeof(magic)) != 0 ||
+      fread(&server->replay_next, sizeof(server->replay_next), 1,
+            server->input_replay) != 1) {
+    wlr_log(WLR_ERROR, "%s is not a recording of input with any events", path);
+    fclose(server->input_replay);
+    return false;
+  }
+
+  /* The virtual devices are set up exactly like real ones */
+  static const struct wlr_keyboard_impl keyboard_impl = {
+      .name = "tinytile-replay-keyboard",
+  };
+  static const struct wlr_pointer_impl pointer_impl = {
+      .name = "tinytile-replay-pointer",
+  };
+  wlr_keyboard_init(&server->replay_keyboard, &keyboard_impl,
+                    keyboard_impl.name);
+  wlr_pointer_init(&server->replay_pointer, &pointer_impl, pointer_impl.name);
+  add_input_device(server, &server->replay_keyboard.base);
+  add_input_device(server, &server->replay_pointer.base);
+
+  /* The replay starts once keymap_job_done arms the timer */
+  server->replay_start_usec = 0;
+  server->replay_events = 0;
+  server->replay_total_lateness_usec = 0;
+  server->replay_max_lateness_usec = 0;
+  server->replay_timer = wl_event_loop_add_timer(
+      wl_display_get_event_loop(server->wl_display), handle_replay_timer,
+      server);
+  return true;
 }
 
 static void xdg_toplevel_map(struct wl_listener* listener, void* data) {
@@ -632,12 +2144,15 @@ static void xdg_toplevel_map(struct wl_listener* listener, void* data) {
   struct wlr_output* monitor = wlr_output_layout_output_at(
       view->server->output_layout, view->server->cursor->x,
       view->server->cursor->y);
-  struct wlr_output_layout_output* monitor_pos =
-      wlr_output_layout_get(view->server->output_layout, monitor);
-  wlr_scene_node_set_position(&view->scene_tree->node, monitor_pos->x,
-                              monitor_pos->y);
-  wlr_xdg_toplevel_set_size(view->xdg_toplevel, monitor->width,
-                            monitor->height);
+  if (monitor) {
+    struct wlr_output_layout_output* monitor_pos =
+        wlr_output_layout_get(view->server->output_layout, monitor);
+    view->box.x = monitor_pos->x;
+    view->box.y = monitor_pos->y;
+    wlr_scene_node_set_position(&view->scene_tree->node, view->box.x,
+                                view->box.y);
+    view_move_to_output(view, monitor);
+  }
 
   wl_list_insert(&view->server->views, &view->link);
 
@@ -670,11 +2185,31 @@ static void xdg_toplevel_destroy(struct wl_listener* listener, void* data) {
   wl_list_remove(&view->map.link);
   wl_list_remove(&view->unmap.link);
   wl_list_remove(&view->destroy.link);
+  wl_list_remove(&view->commit.link);
   wl_list_remove(&view->request_fullscreen.link);
 
   free(view);
 }
 
+static void xdg_toplevel_commit(struct wl_listener* listener, void* data) {
+  /* Called when a new surface state is committed. Once this includes the
+   * size we asked for, the view can be moved to match and the next size
+   * sent. */
+  struct tinytile_view* view = wl_container_of(listener, view, commit);
+  if (view->configure_serial == 0 ||
+      (int32_t)(view->xdg_toplevel->base->current.configure_serial -
+                view->configure_serial) < 0) {
+    return;
+  }
+  view->configure_serial = 0;
+  view->box = view->configure_box;
+  wlr_scene_node_set_position(&view->scene_tree->node, view->box.x,
+                              view->box.y);
+  if (view->has_pending_box) {
+    view_flush_geometry(view);
+  }
+}
+
 static void xdg_toplevel_request_fullscreen(struct wl_listener* listener,
                                             void* data) {
   struct tinytile_view* view =
@@ -730,6 +2265,8 @@ static void server_new_xdg_surface(struct wl_listener* listener, void* data) {
   wl_signal_add(&xdg_surface->events.unmap, &view->unmap);
   view->destroy.notify = xdg_toplevel_destroy;
   wl_signal_add(&xdg_surface->events.destroy, &view->destroy);
+  view->commit.notify = xdg_toplevel_commit;
+  wl_signal_add(&xdg_surface->surface->events.commit, &view->commit);
 
   /* cotd */
   struct wlr_xdg_toplevel* toplevel = xdg_surface->toplevel;
@@ -739,6 +2276,7 @@ static void server_new_xdg_surface(struct wl_listener* listener, void* data) {
 }
 
 int main(int argc, char* argv[]) {
+  int64_t startup_usec = clock_usec(CLOCK_MONOTONIC);
   wlr_log_init(WLR_DEBUG, NULL);
 
   if (argc > 1) {
@@ -755,12 +2293,53 @@ int main(int argc, char* argv[]) {
         keyboard_layout = argv[_ + 1];
       else if (!strcmp(argv[_], "keyboardOptns"))
         keyboard_optns = replace_char(argv[_ + 1], '_', ' ');
-      else {
+      else if (!strcmp(argv[_], "controlPipe"))
+        control_pipe = argv[_ + 1];
+      else if (!strcmp(argv[_], "autostart")) {
+        if (autostart_count == 16) {
+          wlr_log(WLR_ERROR, "Please give autostart up to 16 times");
+          exit(EXIT_FAILURE);
+        }
+        autostart_commands[autostart_count++] =
+            replace_char(argv[_ + 1], '_', ' ');
+      } else if (!strcmp(argv[_], "recordInput"))
+        record_input_path = argv[_ + 1];
+      else if (!strcmp(argv[_], "replayInput"))
+        replay_input_path = argv[_ + 1];
+      else if (!strcmp(argv[_], "pointerAccel"))
+        add_pointer_accel(replace_char(argv[_ + 1], '_', ' '));
+      else if (!strcmp(argv[_], "idleTimeout")) {
+        /* The timer takes an int number of milliseconds */
+        char* end;
+        unsigned long seconds = strtoul(argv[_ + 1], &end, 10);
+        if (!isdigit((unsigned char)argv[_ + 1][0]) || *end != '\0' ||
+            seconds > INT_MAX / 1000) {
+          wlr_log(WLR_ERROR,
+                  "Please give idleTimeout as a number of seconds up to %d "
+                  "instead of '%s'",
+                  INT_MAX / 1000, argv[_ + 1]);
+          exit(EXIT_FAILURE);
+        }
+        idle_timeout = seconds;
+      } else if (!strcmp(argv[_], "outputMode")) {
+        if (!strcmp(argv[_ + 1], "preferred"))
+          output_mode_policy = OUTPUT_MODE_PREFERRED;
+        else if (!strcmp(argv[_ + 1], "highestRefresh"))
+          output_mode_policy = OUTPUT_MODE_HIGHEST_REFRESH;
+        else {
+          wlr_log(WLR_ERROR,
+                  "Please say either preferred or highestRefresh instead of "
+                  "'%s'",
+                  argv[_ + 1]);
+          exit(EXIT_FAILURE);
+        }
+      } else {
         wlr_log(
             WLR_ERROR,
             "The option '%s' is not a valid option please choose from either "
-            "browser, terminal, systemMonitor, keyboardLayout, hideCursor or "
-            "keyboardOptns.",
+            "browser, terminal, systemMonitor, keyboardLayout, hideCursor, "
+            "keyboardOptns, controlPipe, outputMode, idleTimeout, recordInput, "
+            "replayInput, pointerAccel or autostart.",
             argv[_]);
         exit(1);
       }
@@ -768,6 +2347,9 @@ int main(int argc, char* argv[]) {
   }
 
   struct tinytile_server server;
+  server.startup_usec = startup_usec;
+  server.startup_phase_usec = startup_usec;
+  server.first_frame_done = false;
   /* The Wayland display is managed by libwayland. It handles accepting
    * clients from the Unix socket, manging Wayland globals, and so on. */
   server.wl_display = wl_display_create();
@@ -781,6 +2363,17 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  /* We add a headless backend alongside whatever was autocreated, it has no
+   * outputs to begin with but lets us create virtual outputs at runtime for
+   * headless and remote-desktop sessions. */
+  server.headless_backend = wlr_headless_backend_create(server.wl_display);
+  if (server.headless_backend == NULL) {
+    wlr_log(WLR_ERROR, "failed to create the headless wlr_backend");
+    return 1;
+  }
+  wlr_multi_backend_add(server.backend, server.headless_backend);
+  log_startup_phase(&server, "creating the backend");
+
   /* Autocreates a renderer, either Pixman, GLES2 or Vulkan for us. The user
    * can also specify a renderer using the WLR_RENDERER env var.
    * The renderer is responsible for defining the various pixel formats it
@@ -802,6 +2395,7 @@ int main(int argc, char* argv[]) {
     wlr_log(WLR_ERROR, "failed to create wlr_allocator");
     return 1;
   }
+  log_startup_phase(&server, "creating the renderer and allocator");
 
   /* This creates some hands-off wlroots interfaces. The compositor is
    * necessary for clients to allocate surfaces, the subcompositor allows to
@@ -817,6 +2411,19 @@ int main(int argc, char* argv[]) {
   /* Creates an output layout, which a wlroots utility for working with an
    * arrangement of screens in a physical layout. */
   server.output_layout = wlr_output_layout_create();
+  server.output_layout_change.notify = server_output_layout_change;
+  wl_signal_add(&server.output_layout->events.change,
+                &server.output_layout_change);
+
+  /* The output manager lets clients such as wlr-randr or kanshi configure
+   * the mode, position, scale and enabled state of outputs */
+  server.output_manager = wlr_output_manager_v1_create(server.wl_display);
+  server.output_manager_apply.notify = output_manager_apply;
+  wl_signal_add(&server.output_manager->events.apply,
+                &server.output_manager_apply);
+  server.output_manager_test.notify = output_manager_test;
+  wl_signal_add(&server.output_manager->events.test,
+                &server.output_manager_test);
 
   /* Configure a listener to be notified when new outputs are available on the
    * backend. */
@@ -854,9 +2461,10 @@ int main(int argc, char* argv[]) {
   /* Creates an xcursor manager, another wlroots utility which loads up
    * Xcursor themes to source cursor images from and makes sure that cursor
    * images are available at all scale factors on the screen (necessary for
-   * HiDPI support). We add a cursor theme at scale factor 1 to begin with. */
+   * HiDPI support). A cursor theme at scale factor 1 is added when the cursor
+   * is first shown, see set_default_cursor_image. */
   server.cursor_mgr = wlr_xcursor_manager_create(NULL, 24);
-  wlr_xcursor_manager_load(server.cursor_mgr, 1);
+  server.cursor_theme_loaded = false;
 
   /*
    * wlr_cursor *only* displays an image on screen. It does not move around
@@ -882,6 +2490,18 @@ int main(int argc, char* argv[]) {
   server.cursor_frame.notify = server_cursor_frame;
   wl_signal_add(&server.cursor->events.frame, &server.cursor_frame);
 
+  /* The relative pointer manager sends clients unaccelerated pointer deltas,
+   * and pointer constraints let them lock or confine the pointer. Together
+   * these are what games need. */
+  server.relative_pointer_manager =
+      wlr_relative_pointer_manager_v1_create(server.wl_display);
+  server.pointer_constraints =
+      wlr_pointer_constraints_v1_create(server.wl_display);
+  server.active_constraint = NULL;
+  server.new_pointer_constraint.notify = server_new_pointer_constraint;
+  wl_signal_add(&server.pointer_constraints->events.new_constraint,
+                &server.new_pointer_constraint);
+
   /*
    * Configures a seat, which is a single "seat" at which a user sits and
    * operates the computer. This conceptually includes up to one keyboard,
@@ -899,6 +2519,32 @@ int main(int argc, char* argv[]) {
   wl_signal_add(&server.seat->events.request_set_selection,
                 &server.request_set_selection);
 
+  /* The idle notifier tells clients such as swayidle when the user has been
+   * inactive for a while, the idle inhibit manager lets clients such as video
+   * players prevent this and the output power manager lets clients turn
+   * outputs off. We also turn the outputs off ourselves after idleTimeout
+   * seconds if that is set. */
+  server.idle_notifier = wlr_idle_notifier_v1_create(server.wl_display);
+  server.idle_inhibit_manager = wlr_idle_inhibit_v1_create(server.wl_display);
+  server.idle_inhibitors = 0;
+  server.new_idle_inhibitor.notify = server_new_idle_inhibitor;
+  wl_signal_add(&server.idle_inhibit_manager->events.new_inhibitor,
+                &server.new_idle_inhibitor);
+  server.output_power_manager =
+      wlr_output_power_manager_v1_create(server.wl_display);
+  server.output_power_set_mode.notify = output_power_set_mode;
+  wl_signal_add(&server.output_power_manager->events.set_mode,
+                &server.output_power_set_mode);
+  server.outputs_idle = false;
+  server.last_activity_msec = now_msec();
+  server.idle_timer = wl_event_loop_add_timer(
+      wl_display_get_event_loop(server.wl_display), handle_idle_timer, &server);
+  if (idle_timeout > 0) {
+    wl_event_source_timer_update(server.idle_timer, idle_timeout * 1000);
+  }
+
+  log_startup_phase(&server, "creating the globals");
+
   /* Add a Unix socket to the Wayland display. */
   const char* socket = wl_display_add_socket_auto(server.wl_display);
   if (!socket) {
@@ -906,6 +2552,57 @@ int main(int argc, char* argv[]) {
     return 1;
   }
 
+  /* SIGINT and SIGTERM are how scripts, such as benchmarks, stop us. This
+   * blocks them, so it has to happen before any threads are started, or they
+   * could be delivered to a thread that doesn't block them and kill us. */
+  server.sigint_source =
+      wl_event_loop_add_signal(wl_display_get_event_loop(server.wl_display),
+                               SIGINT, handle_terminate_signal, &server);
+  server.sigterm_source =
+      wl_event_loop_add_signal(wl_display_get_event_loop(server.wl_display),
+                               SIGTERM, handle_terminate_signal, &server);
+  if (server.sigint_source == NULL || server.sigterm_source == NULL) {
+    wlr_log(WLR_ERROR, "failed to handle SIGINT and SIGTERM");
+    wlr_backend_destroy(server.backend);
+    wl_display_destroy(server.wl_display);
+    return 1;
+  }
+
+  /* Set the WAYLAND_DISPLAY environment variable to our socket. This must
+   * happen before any threads are started, because setenv isn't thread safe
+   * and the workers read the environment. */
+  setenv("WAYLAND_DISPLAY", socket, true);
+
+  /* The worker threads take expensive work, such as compiling the keymap and
+   * launching programs, off the thread that handles input and rendering */
+  if (!start_workers(&server)) {
+    return 1;
+  }
+  server.keymap = NULL;
+  server.exit_status = EXIT_SUCCESS;
+  wl_array_init(&server.held_keys);
+  server.replay_timer = NULL;
+  compile_keymap(&server);
+
+  /* Clients can connect as soon as the socket exists, they just wait until
+   * the event loop runs, so autostarted programs start up in parallel with
+   * the rest of our startup and with each other */
+  for (int i = 0; i < autostart_count; i++) {
+    run(&server, autostart_commands[i]);
+  }
+
+  /* Recording input captures every event from every device, replaying feeds
+   * a recording back through virtual devices with the original timing */
+  server.input_recording = NULL;
+  server.input_replay = NULL;
+  if ((record_input_path &&
+       !start_input_recording(&server, record_input_path)) ||
+      (replay_input_path && !start_input_replay(&server, replay_input_path))) {
+    wlr_backend_destroy(server.backend);
+    wl_display_destroy(server.wl_display);
+    return 1;
+  }
+
   /* Start the backend. This will enumerate outputs and inputs, become the DRM
    * master, etc */
   if (!wlr_backend_start(server.backend)) {
@@ -913,20 +2610,31 @@ int main(int argc, char* argv[]) {
     wl_display_destroy(server.wl_display);
     return 1;
   }
+  log_startup_phase(&server, "starting the backend");
 
   /* Either creates the cursor in its pocket if that is enabled, otherwise
-   * it is shown on the screen */
+   * it is shown on the screen once the first frame has been rendered */
   if (hide_cursor_at_top_left)
     wlr_cursor_warp_closest(server.cursor, NULL, 0, 0);
-  else {
+  else
     /* HACK: creates the cursor image which is normaly hidden */
     wlr_cursor_warp_closest(server.cursor, NULL, 100, 100);
-    wlr_xcursor_manager_set_cursor_image(server.cursor_mgr, "left_ptr",
-                                         server.cursor);
+
+  /* The session is NULL when we are nested, or running headless, in which
+   * case it is always active */
+  server.session = wlr_backend_get_session(server.backend);
+  if (server.session) {
+    server.session_active.notify = server_session_active;
+    wl_signal_add(&server.session->events.active, &server.session_active);
   }
 
-  /* Set the WAYLAND_DISPLAY environment variable to our socket */
-  setenv("WAYLAND_DISPLAY", socket, true);
+  /* Listen for commands such as creating virtual outputs */
+  server.control_pipe_source = NULL;
+  if (control_pipe && !open_control_pipe(&server, control_pipe)) {
+    wlr_backend_destroy(server.backend);
+    wl_display_destroy(server.wl_display);
+    return 1;
+  }
 
   /* Run the Wayland event loop. This does not return until you exit the
    * compositor. Starting the backend rigged up all of the necessary event
@@ -936,7 +2644,18 @@ int main(int argc, char* argv[]) {
   wl_display_run(server.wl_display);
 
   /* Once wl_display_run returns, we shut down the server. */
+  wl_event_source_remove(server.sigint_source);
+  wl_event_source_remove(server.sigterm_source);
+  if (server.control_pipe_source) {
+    close_control_pipe(&server, control_pipe);
+  }
+  stop_workers(&server);
+  xkb_keymap_unref(server.keymap);
+  wl_array_release(&server.held_keys);
+  if (server.input_recording) {
+    fclose(server.input_recording);
+  }
   wl_display_destroy_clients(server.wl_display);
   wl_display_destroy(server.wl_display);
-  return EXIT_SUCCESS;
+  return server.exit_status;
 }